@@ -0,0 +1,102 @@
+//
+// arena.cpp
+//
+// Implementation.
+//
+
+#include <stdlib.h>
+#include "arena.h"
+
+Arena* Arena::active_ = NULL;
+
+Arena::Arena(char* buffer, size_t size, OverflowHandler handler)
+    : buffer_(buffer), size_(size), used_(0), last_(0), high_water_(0),
+      overflow_bytes_(0), overflow_count_(0), handler_(handler)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation.
+
+void* Arena::allocate(size_t bytes)
+{
+    size_t start = (used_ + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    if (start + bytes > size_) {
+        overflow_bytes_ += bytes;
+        overflow_count_++;
+        return malloc(bytes);
+    }
+
+    last_ = start;
+    used_ = start + bytes;
+    if (used_ > high_water_) high_water_ = used_;
+    return buffer_ + start;
+}
+
+// Arena memory is reclaimed by reset(), except that freeing the most recent
+// allocation rolls it back straight away. Heap overflow is freed right away.
+void Arena::deallocate(void* p)
+{
+    char* c = static_cast<char*>(p);
+    if (c >= buffer_ && c < buffer_ + size_) {
+        if (c == buffer_ + last_) used_ = last_;
+        return;
+    }
+    free(p);
+}
+
+void Arena::reset()
+{
+    if (overflow_count_ > 0 && handler_ != NULL) handler_(*this);
+    used_ = 0;
+    last_ = 0;
+    overflow_bytes_ = 0;
+    overflow_count_ = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Accessors.
+
+size_t Arena::size() const
+{
+    return size_;
+}
+
+size_t Arena::highWater() const
+{
+    return high_water_;
+}
+
+size_t Arena::overflowBytes() const
+{
+    return overflow_bytes_;
+}
+
+unsigned int Arena::overflowCount() const
+{
+    return overflow_count_;
+}
+
+Arena* Arena::active()
+{
+    return active_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scope.
+
+// Building with ARENA_DISABLED leaves every scope inactive, so all arena
+// backed objects use the heap. The host benchmark uses it as its baseline.
+ArenaScope::ArenaScope(Arena& arena)
+    : arena_(arena), previous_(Arena::active_)
+{
+#ifndef ARENA_DISABLED
+    Arena::active_ = &arena_;
+#endif
+}
+
+ArenaScope::~ArenaScope()
+{
+    Arena::active_ = previous_;
+    if (previous_ != &arena_) arena_.reset();
+}
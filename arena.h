@@ -0,0 +1,144 @@
+//
+// arena.h
+//
+// Header file for the bump-pointer arena and its STL allocator.
+//
+#include <stddef.h>
+#include <string>
+#include <sstream>
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#define ARENA_ALIGNMENT 8
+
+////////////////////////////////////////////////////////////////////////////////
+// Arena Class definition.
+//
+// Hands out memory from a fixed buffer by bumping an offset, and frees it all
+// at once on reset(). Requests that do not fit fall back to the heap and are
+// counted, so the owner can be told the buffer is too small.
+
+class Arena
+{
+  public:
+    // Called from reset() when the cycle just ended spilled onto the heap.
+    typedef void (*OverflowHandler)(const Arena& arena);
+
+    Arena(char* buffer, size_t size, OverflowHandler handler);
+    void* allocate(size_t bytes);
+    void deallocate(void* p);
+    void reset();
+
+    size_t size() const;
+    size_t highWater() const;
+    size_t overflowBytes() const;
+    unsigned int overflowCount() const;
+
+    // The arena new allocators bind to, or NULL to use the heap.
+    static Arena* active();
+
+  private:
+    friend class ArenaScope;
+
+    char* buffer_;
+    size_t size_;
+    size_t used_;
+    size_t last_;
+    size_t high_water_;
+    size_t overflow_bytes_;
+    unsigned int overflow_count_;
+    OverflowHandler handler_;
+
+    static Arena* active_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// ArenaScope Class definition.
+//
+// Makes an arena active for the lifetime of the scope. The outermost scope
+// resets the arena on the way out, so it must be declared before any arena
+// backed object in the same block.
+
+class ArenaScope
+{
+  public:
+    ArenaScope(Arena& arena);
+    ~ArenaScope();
+
+  private:
+    Arena& arena_;
+    Arena* previous_;
+
+    ArenaScope(const ArenaScope&);
+    ArenaScope& operator=(const ArenaScope&);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// ArenaAllocator Class definition.
+//
+// Binds to whichever arena is active when it is constructed and keeps using
+// it, so objects built outside any scope simply live on the heap.
+
+template <typename T>
+class ArenaAllocator
+{
+  public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U> struct rebind { typedef ArenaAllocator<U> other; };
+
+    ArenaAllocator() : arena_(Arena::active()) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+    pointer allocate(size_type n, const void* hint = 0)
+    {
+        if (arena_ == NULL) return static_cast<pointer>(::operator new(n * sizeof(T)));
+        return static_cast<pointer>(arena_->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        if (arena_ == NULL) {
+            ::operator delete(p);
+        } else {
+            arena_->deallocate(p);
+        }
+    }
+
+    size_type max_size() const { return size_t(-1) / sizeof(T); }
+    void construct(pointer p, const T& value) { new (static_cast<void*>(p)) T(value); }
+    void destroy(pointer p) { p->~T(); }
+
+    Arena* arena() const { return arena_; }
+
+  private:
+    Arena* arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return a.arena() != b.arena();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Arena backed string types.
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > ArenaString;
+typedef std::basic_ostringstream<char, std::char_traits<char>, ArenaAllocator<char> > ArenaStringStream;
+
+#endif // ARENA_H
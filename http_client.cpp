@@ -0,0 +1,237 @@
+//
+// http_client.cpp
+//
+// Implementation.
+//
+
+#include <stdlib.h>
+#include <ctype.h>
+#include "http_client.h"
+
+HttpClient::HttpClient(Callback callback)
+    : callback_(callback), head_(0), count_(0), state_(kIdle),
+      client_port_(0), deadline_ms_(0), retry_at_ms_(0),
+      unreachable_port_(0), unreachable_until_ms_(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Queue.
+
+// Returns false without queueing when the peer is cooling down after a failed
+// connect, or when the ring is already full. A request that is still waiting
+// to be sent to the same peer is superseded in place, so repeated state
+// changes collapse into the latest one.
+bool HttpClient::enqueue(IPAddress host, uint16_t port, const std::string& message, int tag)
+{
+    if (isUnreachable(host, port)) return false;
+
+    HttpRequest* request = NULL;
+    for (unsigned int i = 0; i < count_; i++) {
+        if (i == 0 && state_ == kWaiting) continue;
+        HttpRequest& queued = queue_[(head_ + i) % HTTP_CLIENT_QUEUE_SIZE];
+        if (queued.host == host && queued.port == port) request = &queued;
+    }
+
+    if (request == NULL) {
+        if (count_ == HTTP_CLIENT_QUEUE_SIZE) return false;
+        request = &queue_[(head_ + count_) % HTTP_CLIENT_QUEUE_SIZE];
+        count_++;
+    }
+
+    request->host = host;
+    request->port = port;
+    request->message = message;
+    request->tag = tag;
+    request->attempts = 0;
+    return true;
+}
+
+unsigned int HttpClient::pending()
+{
+    return count_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// State machine.
+
+void HttpClient::process()
+{
+    if (state_ == kIdle) {
+        if (count_ == 0) return;
+        if ((long) (millis() - retry_at_ms_) < 0) return;
+
+        HttpRequest& request = queue_[head_];
+        request.attempts++;
+
+        // Connecting blocks, so a peer that refuses is not tried again until
+        // its cool-down has passed, and nothing else queued for it is kept
+        if (!connect(request)) {
+            unreachable_host_ = request.host;
+            unreachable_port_ = request.port;
+            unreachable_until_ms_ = millis() + HTTP_CLIENT_UNREACHABLE_MS;
+            dropPeer(request.host, request.port);
+            return;
+        }
+
+        if (send(request)) {
+            response_.clear();
+            deadline_ms_ = millis() + HTTP_CLIENT_TIMEOUT_MS;
+            state_ = kWaiting;
+        } else {
+            fail();
+        }
+        return;
+    }
+
+    // Take whatever has arrived so far without waiting for more
+    uint8_t chunk[64];
+    while (client_.available() && response_.length() < HTTP_CLIENT_RESPONSE_SIZE) {
+        int read = client_.read(chunk, sizeof(chunk));
+        if (read <= 0) break;
+        response_.append((const char*) chunk, read);
+    }
+
+    if (isComplete()) {
+        int status = parseStatus();
+        if (status > 0) {
+            complete(status);
+        } else {
+            fail();
+        }
+    } else if ((long) (millis() - deadline_ms_) >= 0) {
+        fail();
+    }
+}
+
+// Reuses the open connection when it already goes to this peer.
+bool HttpClient::connect(const HttpRequest& request)
+{
+    if (client_.connected() &&
+        client_host_ == request.host && client_port_ == request.port) {
+        return true;
+    }
+
+    disconnect();
+    if (!client_.connect(request.host, request.port)) return false;
+    client_host_ = request.host;
+    client_port_ = request.port;
+    return true;
+}
+
+bool HttpClient::send(const HttpRequest& request)
+{
+    // A single write so the peer sees the whole request in one read
+    size_t written = client_.write((const uint8_t*) request.message.c_str(),
+                                   request.message.length());
+    return written == request.message.length();
+}
+
+// The response is done once the body promised by Content-Length is in, the
+// peer closed the connection, or the buffer is full.
+bool HttpClient::isComplete()
+{
+    if (!client_.connected()) return true;
+    if (response_.length() >= HTTP_CLIENT_RESPONSE_SIZE) return true;
+
+    size_t header_end = response_.find("\r\n\r\n");
+    if (header_end == std::string::npos) return false;
+
+    const std::string headers = lowerHeaders();
+    size_t length_pos = headers.find("content-length:");
+    if (length_pos == std::string::npos) return false;
+
+    size_t content_length = strtoul(headers.c_str() + length_pos + 15, NULL, 10);
+    return response_.length() - (header_end + 4) >= content_length;
+}
+
+// Header names are case-insensitive, so match against a lowercased copy.
+std::string HttpClient::lowerHeaders()
+{
+    std::string headers = response_.substr(0, response_.find("\r\n\r\n"));
+    for (size_t i = 0; i < headers.length(); i++) {
+        headers[i] = tolower(headers[i]);
+    }
+    return headers;
+}
+
+// Status code from "HTTP/1.1 200 OK", or -1 when there is no status line.
+int HttpClient::parseStatus()
+{
+    if (response_.compare(0, 5, "HTTP/") != 0) return -1;
+
+    size_t space = response_.find(' ');
+    if (space == std::string::npos) return -1;
+    return atoi(response_.c_str() + space + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Completion.
+
+void HttpClient::complete(int status)
+{
+    HttpRequest request = queue_[head_];
+    head_ = (head_ + 1) % HTTP_CLIENT_QUEUE_SIZE;
+    count_--;
+    state_ = kIdle;
+    retry_at_ms_ = millis();
+
+    if (lowerHeaders().find("connection: close") != std::string::npos) disconnect();
+
+    if (callback_ != NULL) callback_(request, status);
+}
+
+// Retry with exponential backoff, dropping the request after the last attempt.
+void HttpClient::fail()
+{
+    disconnect();
+    state_ = kIdle;
+
+    HttpRequest& request = queue_[head_];
+    if (request.attempts < HTTP_CLIENT_MAX_ATTEMPTS) {
+        retry_at_ms_ = millis() + (HTTP_CLIENT_BACKOFF_MS << (request.attempts - 1));
+        return;
+    }
+
+    HttpRequest dropped = request;
+    head_ = (head_ + 1) % HTTP_CLIENT_QUEUE_SIZE;
+    count_--;
+    retry_at_ms_ = millis();
+
+    if (callback_ != NULL) callback_(dropped, -1);
+}
+
+bool HttpClient::isUnreachable(IPAddress host, uint16_t port)
+{
+    return unreachable_port_ == port && unreachable_host_ == host &&
+           (long) (millis() - unreachable_until_ms_) < 0;
+}
+
+// Remove every queued request for the peer, then report each as failed.
+void HttpClient::dropPeer(IPAddress host, uint16_t port)
+{
+    HttpRequest dropped[HTTP_CLIENT_QUEUE_SIZE];
+    unsigned int dropped_count = 0;
+    unsigned int kept = 0;
+
+    for (unsigned int i = 0; i < count_; i++) {
+        HttpRequest& request = queue_[(head_ + i) % HTTP_CLIENT_QUEUE_SIZE];
+        if (request.host == host && request.port == port) {
+            dropped[dropped_count++] = request;
+        } else {
+            queue_[(head_ + kept++) % HTTP_CLIENT_QUEUE_SIZE] = request;
+        }
+    }
+    count_ = kept;
+    state_ = kIdle;
+    retry_at_ms_ = millis();
+
+    if (callback_ == NULL) return;
+    for (unsigned int i = 0; i < dropped_count; i++) callback_(dropped[i], -1);
+}
+
+void HttpClient::disconnect()
+{
+    if (client_.connected()) client_.stop();
+    client_port_ = 0;
+}
@@ -0,0 +1,108 @@
+//
+// http_client.h
+//
+// Header file for a small non-blocking outbound HTTP client.
+//
+#include <inttypes.h>
+#include <string>
+
+#include "application.h"
+
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+// Tunables, overridable at build time (the host tests shorten the timers)
+#ifndef HTTP_CLIENT_QUEUE_SIZE
+#define HTTP_CLIENT_QUEUE_SIZE 4
+#endif
+#ifndef HTTP_CLIENT_RESPONSE_SIZE
+#define HTTP_CLIENT_RESPONSE_SIZE 512
+#endif
+#ifndef HTTP_CLIENT_TIMEOUT_MS
+#define HTTP_CLIENT_TIMEOUT_MS 3000
+#endif
+#ifndef HTTP_CLIENT_MAX_ATTEMPTS
+#define HTTP_CLIENT_MAX_ATTEMPTS 4
+#endif
+#ifndef HTTP_CLIENT_BACKOFF_MS
+#define HTTP_CLIENT_BACKOFF_MS 250
+#endif
+#ifndef HTTP_CLIENT_UNREACHABLE_MS
+#define HTTP_CLIENT_UNREACHABLE_MS 30000
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Queued request. The message is a fully rendered HTTP request; the tag is
+// handed back untouched so the caller can tell its requests apart.
+
+struct HttpRequest
+{
+    IPAddress host;
+    uint16_t port;
+    std::string message;
+    int tag;
+    int attempts;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// HttpClient Class definition.
+//
+// Requests go into a bounded ring and are worked off one step at a time from
+// process(), which is meant to be called on every pass of loop(). Reading the
+// response, timeouts and retry backoff never block.
+//
+// Opening a connection does block loop(), as TCPClient::connect() offers no
+// asynchronous form: for the handshake with a live peer, and for the full
+// system connect timeout with one that is offline. The connection is reused
+// while the next request targets the same peer and the peer did not ask to
+// close it, which only helps keep-alive peers; a Fauxmo closes after every
+// reply, so each request to one pays a blocking connect. To bound the offline
+// case, a failed connect is never retried: every request queued for that peer
+// is dropped and new ones are refused for HTTP_CLIENT_UNREACHABLE_MS, after
+// which the next request blocks again.
+
+class HttpClient
+{
+  public:
+    // Called once per request with the HTTP status, or -1 once all attempts
+    // have failed.
+    typedef void (*Callback)(const HttpRequest& request, int status);
+
+    HttpClient(Callback callback);
+    bool enqueue(IPAddress host, uint16_t port, const std::string& message, int tag);
+    void process();
+    unsigned int pending();
+
+  private:
+    enum State { kIdle, kWaiting };
+
+    Callback callback_;
+    HttpRequest queue_[HTTP_CLIENT_QUEUE_SIZE];
+    unsigned int head_;
+    unsigned int count_;
+
+    State state_;
+    TCPClient client_;
+    IPAddress client_host_;
+    uint16_t client_port_;
+    std::string response_;
+    unsigned long deadline_ms_;
+    unsigned long retry_at_ms_;
+
+    IPAddress unreachable_host_;
+    uint16_t unreachable_port_;
+    unsigned long unreachable_until_ms_;
+
+    bool connect(const HttpRequest& request);
+    bool send(const HttpRequest& request);
+    bool isComplete();
+    std::string lowerHeaders();
+    int parseStatus();
+    void complete(int status);
+    void fail();
+    bool isUnreachable(IPAddress host, uint16_t port);
+    void dropPeer(IPAddress host, uint16_t port);
+    void disconnect();
+};
+
+#endif // HTTP_CLIENT_H
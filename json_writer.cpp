@@ -0,0 +1,130 @@
+//
+// json_writer.cpp
+//
+// Implementation.
+//
+
+#include <stdio.h>
+#include "json_writer.h"
+
+JsonWriter::JsonWriter(Print* sink)
+    : sink_(sink), length_(0), used_(0), first_(true)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Structure. Commas are inserted automatically between members and elements;
+// a key is always followed directly by its value.
+
+void JsonWriter::beginObject()
+{
+    separate();
+    put('{');
+    first_ = true;
+}
+
+void JsonWriter::endObject()
+{
+    put('}');
+    first_ = false;
+}
+
+void JsonWriter::beginArray()
+{
+    separate();
+    put('[');
+    first_ = true;
+}
+
+void JsonWriter::endArray()
+{
+    put(']');
+    first_ = false;
+}
+
+void JsonWriter::key(const char* name)
+{
+    separate();
+    quoted(name);
+    put(':');
+    first_ = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Values.
+
+void JsonWriter::value(const char* text)
+{
+    separate();
+    quoted(text);
+}
+
+void JsonWriter::value(int number)
+{
+    char digits[12];
+    snprintf(digits, sizeof(digits), "%d", number);
+    separate();
+    raw(digits);
+}
+
+void JsonWriter::value(bool flag)
+{
+    separate();
+    raw(flag ? "true" : "false");
+}
+
+// Push out anything still buffered and return the total document length.
+size_t JsonWriter::finish()
+{
+    flush();
+    return length_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Output helpers.
+
+void JsonWriter::separate()
+{
+    if (!first_) put(',');
+    first_ = false;
+}
+
+void JsonWriter::quoted(const char* text)
+{
+    put('"');
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            put('\\');
+            put(*c);
+        } else if ((unsigned char) *c < 0x20) {
+            char escape[7];
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char) *c);
+            raw(escape);
+        } else {
+            put(*c);
+        }
+    }
+    put('"');
+}
+
+void JsonWriter::raw(const char* text)
+{
+    for (const char* c = text; *c; c++) put(*c);
+}
+
+void JsonWriter::put(char c)
+{
+    length_++;
+    if (sink_ == NULL) return;
+
+    buffer_[used_++] = c;
+    if (used_ == JSON_WRITER_BUFFER_SIZE) flush();
+}
+
+void JsonWriter::flush()
+{
+    if (sink_ != NULL && used_ > 0) {
+        sink_->write((const uint8_t*) buffer_, used_);
+    }
+    used_ = 0;
+}
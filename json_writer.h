@@ -0,0 +1,52 @@
+//
+// json_writer.h
+//
+// Header file for a small streaming JSON serializer.
+//
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "application.h"
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#define JSON_WRITER_BUFFER_SIZE 64
+
+////////////////////////////////////////////////////////////////////////////////
+// JsonWriter Class definition.
+//
+// Emits JSON through a fixed buffer into any Print sink (e.g. a TCPClient) so
+// a document never has to be built up in memory. With no sink, the writer only
+// counts bytes, which lets a caller render once to learn the Content-Length
+// and a second time to send the body.
+
+class JsonWriter
+{
+  public:
+    JsonWriter(Print* sink);
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+    void key(const char* name);
+    void value(const char* text);
+    void value(int number);
+    void value(bool flag);
+    size_t finish();
+
+  private:
+    Print* sink_;
+    size_t length_;
+    size_t used_;
+    bool first_;
+    char buffer_[JSON_WRITER_BUFFER_SIZE];
+
+    void separate();
+    void quoted(const char* text);
+    void raw(const char* text);
+    void put(char c);
+    void flush();
+};
+
+#endif // JSON_WRITER_H
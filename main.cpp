@@ -3,21 +3,60 @@
 #include <sstream>
 #include <iterator>
 #include "uuid.h"
+#include "json_writer.h"
+#include "http_client.h"
+#include "arena.h"
 
 #include "application.h"
 
 #define ENABLE_DEBUG 1
-#define TO_STRING(x) static_cast< std::ostringstream & >(( std::ostringstream() << std::dec << x )).str()
+#define TO_STRING(x) toArenaString(x)
 #define WEB_EXPECTED_REQUEST_SIZE 1024
 
+// Scratch memory for the network handlers, reset after every request. The
+// worst case measured by `make host-bench` (64 character name, 15 character
+// address, Hue description.xml) peaks at about 3 KB, 1 KB of it the request.
+#ifndef REQUEST_ARENA_SIZE
+#define REQUEST_ARENA_SIZE 1024 * 4
+#endif
+
+// Per-pass budget for draining queued packets and connections
+#define LOOP_DRAIN_BUDGET_US 20000
+#define LOOP_DRAIN_MAX_ITEMS 8
+#define LOOP_STATS_INTERVAL_SEC 60
+#define LOOP_STATS_SIZE 128
+
+// micros() on the Photon is the cycle counter divided down, so it wraps here
+// rather than at 2^32
+#define MICROS_ROLLOVER 35791395UL
+
 // Track last "on" time
 #define ON_TIME_MEMORY_ADDRESS 2044
 #define ON_TIME_UPDATE_INTERVAL_SEC 60 * 5
 #define ON_TIMESTAMP_STALE_SEC 60 * 30
 
-// Send notify updates
+// Send notify updates, re-advertising at half the cache max-age. Each batch is
+// repeated a few times with spacing since SSDP rides on lossy UDP.
+#ifndef CACHE_INTERVAL
 #define CACHE_INTERVAL 60 * 60 * 24
-#define NOTIFY_UPDATE_INTERVAL_SEC CACHE_INTERVAL / 2
+#endif
+#define CACHE_INTERVAL_MIN_SEC 60
+#define CACHE_INTERVAL_MAX_SEC 60 * 60 * 24 * 7
+#define CACHE_INTERVAL_MEMORY_ADDRESS 2028
+#define NOTIFY_BURST_REPEAT 3
+#define NOTIFY_BURST_SPACING_MS 150
+
+// Protocol to emulate, overridable at build time and switchable at run time
+#define PROTOCOL_WEMO 0
+#define PROTOCOL_HUE 1
+#ifndef PROTOCOL_MODE
+#define PROTOCOL_MODE PROTOCOL_WEMO
+#endif
+#define PROTOCOL_MEMORY_ADDRESS 2040
+#define HUE_LIGHT_ID "1"
+
+// Peer Fauxmo driven by the second switch
+#define PEER_MEMORY_ADDRESS 2032
 
 // Config defaults and sizes
 #define DEVICE_NAME "unknown device"
@@ -31,16 +70,24 @@ IPAddress upnp_address( 239, 255, 255, 250 );
 int upnp_port = 1900;
 int web_port = 49153;
 int cache_interval = CACHE_INTERVAL;
+static_assert(CACHE_INTERVAL >= CACHE_INTERVAL_MIN_SEC && CACHE_INTERVAL <= CACHE_INTERVAL_MAX_SEC,
+  "CACHE_INTERVAL out of range");
+int protocol_mode = PROTOCOL_MODE;
 
 // Device control
 const int status_led = D7;
 const int device_out = D0;
 const int control_in = D1;
+const int peer_control_in = D2;
 
 
 // --------------------------------------------------------- Function Prototypes
 void buttonPressInterrupt ();
 void checkButtonPress ();
+void peerButtonPressInterrupt ();
+void checkPeerButtonPress ();
+void handlePeerResponse (const HttpRequest& request, int status);
+void reportArenaOverflow (const Arena& arena);
 
 
 // ------------------------------------------------------------------- Templates
@@ -59,17 +106,42 @@ const std::string wemo_reply_template =
   "USN: uuid:Socket-1_0-{{SERIAL_NUMBER}}::urn:Belkin:device:**\r\n"
   "X-User-Agent: redsonic\r\n"
   "\r\n";
-const std::string wemo_notify_template =
+const std::string hue_search = "urn:schemas-upnp-org:device:basic:1";
+const std::string hue_reply_template =
+  "HTTP/1.1 200 OK\r\n"
+  "HOST: 239.255.255.250:1900\r\n"
+  "CACHE-CONTROL: max-age={{CACHE_INTERVAL}}\r\n"
+  "EXT:\r\n"
+  "LOCATION: http://{{IP_ADDRESS}}:{{WEB_PORT}}/description.xml\r\n"
+  "SERVER: Linux/3.14.0 UPnP/1.0 IpBridge/1.17.0\r\n"
+  "hue-bridgeid: {{BRIDGE_ID}}\r\n"
+  "ST: urn:schemas-upnp-org:device:basic:1\r\n"
+  "USN: uuid:{{UUID}}::urn:schemas-upnp-org:device:basic:1\r\n"
+  "\r\n";
+// Hue clients recognise a bridge by IpBridge in SERVER or by hue-bridgeid
+const std::string wemo_server = "Unspecified, UPnP/1.0, Unspecified";
+const std::string hue_server = "Linux/3.14.0 UPnP/1.0 IpBridge/1.17.0";
+const std::string notify_template =
   "NOTIFY * HTTP/1.1\r\n"
   "HOST: 239.255.255.250:1900\r\n"
   "CACHE-CONTROL: max-age={{CACHE_INTERVAL}}\r\n"
-  "LOCATION: http://{{IP_ADDRESS}}:{{WEB_PORT}}/setup.xml\r\n"
-  "NT: upnp:rootdevice\r\n"
+  "LOCATION: http://{{IP_ADDRESS}}:{{WEB_PORT}}{{DESCRIPTION_PATH}}\r\n"
+  "NT: {{NOTIFY_TYPE}}\r\n"
   "NTS: ssdp:alive\r\n"
-  "SERVER: Unspecified, UPnP/1.0, Unspecified\r\n"
-  "USN: uuid:Socket-1_0-{{SERIAL_NUMBER}}::urn:Belkin:device:**\r\n"
+  "SERVER: {{SERVER}}\r\n"
+  "{{BRIDGE_HEADER}}"
+  "USN: {{UNIQUE_NAME}}\r\n"
+  "\r\n";
+const std::string byebye_template =
+  "NOTIFY * HTTP/1.1\r\n"
+  "HOST: 239.255.255.250:1900\r\n"
+  "NT: {{NOTIFY_TYPE}}\r\n"
+  "NTS: ssdp:byebye\r\n"
+  "USN: {{UNIQUE_NAME}}\r\n"
   "\r\n";
 
+const std::string device_type = "urn:DesigngodsNet:device:controllee:1";
+const std::string hue_device_type = "urn:schemas-upnp-org:device:basic:1";
 const std::string setup_request = "GET /setup.xml HTTP/1.1";
 const std::string control_request = "SOAPACTION: \"urn:Belkin:service:basicevent:1#SetBinaryState\"";
 const std::string turn_on_state = "<BinaryState>1</BinaryState>";
@@ -88,7 +160,7 @@ const std::string setup_xml_template =
   "<?xml version=\"1.0\"?>\r\n"
   "<root>\r\n"
   "  <device>\r\n"
-  "    <deviceType>urn:DesigngodsNet:device:controllee:1</deviceType>\r\n"
+  "    <deviceType>{{DEVICE_TYPE}}</deviceType>\r\n"
   "    <friendlyName>{{DEVICE_NAME}}</friendlyName>\r\n"
   "    <manufacturer>Belkin International Inc.</manufacturer>\r\n"
   "    <modelName>Emulated Socket</modelName>\r\n"
@@ -97,6 +169,37 @@ const std::string setup_xml_template =
   "  </device>\r\n"
   "</root>\r\n";
 
+const std::string hue_description_request = "GET /description.xml HTTP/1.1";
+const std::string hue_register_request = "POST /api ";
+const std::string hue_state_request = "PUT /api/";
+const std::string hue_lights_request = "GET /api/";
+const std::string hue_description_template =
+  "<?xml version=\"1.0\"?>\r\n"
+  "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\r\n"
+  "  <specVersion><major>1</major><minor>0</minor></specVersion>\r\n"
+  "  <URLBase>http://{{IP_ADDRESS}}:{{WEB_PORT}}/</URLBase>\r\n"
+  "  <device>\r\n"
+  "    <deviceType>urn:schemas-upnp-org:device:Basic:1</deviceType>\r\n"
+  "    <friendlyName>{{DEVICE_NAME}} ({{IP_ADDRESS}})</friendlyName>\r\n"
+  "    <manufacturer>Royal Philips Electronics</manufacturer>\r\n"
+  "    <manufacturerURL>http://www.philips.com</manufacturerURL>\r\n"
+  "    <modelDescription>Philips hue Personal Wireless Lighting</modelDescription>\r\n"
+  "    <modelName>Philips hue bridge 2012</modelName>\r\n"
+  "    <modelNumber>929000226503</modelNumber>\r\n"
+  "    <serialNumber>{{SERIAL_NUMBER}}</serialNumber>\r\n"
+  "    <UDN>uuid:{{UUID}}</UDN>\r\n"
+  "    <presentationURL>index.html</presentationURL>\r\n"
+  "  </device>\r\n"
+  "</root>\r\n";
+const std::string json_header_template =
+  "HTTP/1.1 200 OK\r\n"
+  "CONTENT-LENGTH: {{CONTENT_LENGTH}}\r\n"
+  "CONTENT-TYPE: application/json\r\n"
+  "DATE: {{TIMESTAMP}}\r\n"
+  "SERVER: Linux/3.14.0 UPnP/1.0 IpBridge/1.17.0\r\n"
+  "CONNECTION: close\r\n"
+  "\r\n";
+
 const std::string control_response_template =
   "HTTP/1.1 200 OK\r\n"
   "CONTENT-LENGTH: 295\r\n"
@@ -108,6 +211,21 @@ const std::string control_response_template =
   "Content-length: 4"
   "\r\n"
   "OK\r\n";
+const std::string peer_control_template =
+  "POST /upnp/control/basicevent1 HTTP/1.1\r\n"
+  "HOST: {{PEER_ADDRESS}}\r\n"
+  "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+  "SOAPACTION: \"urn:Belkin:service:basicevent:1#SetBinaryState\"\r\n"
+  "CONTENT-LENGTH: {{CONTENT_LENGTH}}\r\n"
+  "CONNECTION: keep-alive\r\n"
+  "\r\n"
+  "{{SOAP_BODY}}";
+const std::string peer_control_body_template =
+  "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+  "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+  "<s:Body><u:SetBinaryState xmlns:u=\"urn:Belkin:service:basicevent:1\">"
+  "<BinaryState>{{BINARY_STATE}}</BinaryState>"
+  "</u:SetBinaryState></s:Body></s:Envelope>";
 const std::string four_oh_four =
   "HTTP/1.1 404 Not Found\r\n"
   "Content-type: text/html\r\n"
@@ -125,13 +243,47 @@ static char HEX_DIGITS[] = "0123456789abcdef";
 IPAddress ip_address;
 std::string device_uuid;
 std::string device_serial;
+std::string hue_bridge_id;
+std::string hue_unique_id;
 int device_state = 0;
 bool button_press_flag = false;
+bool peer_button_press_flag = false;
+int peer_state = 0;
+
+// SSDP advertisements, pre-rendered whenever the device identity changes
+struct NotifyBurst {
+  bool alive;
+  std::vector<std::string> packets;
+  int repeats_left;
+  unsigned long next_send_ms;
+};
+std::vector<std::string> notify_alive_batch;
+std::vector<std::string> notify_byebye_batch;
+std::vector<NotifyBurst> notify_queue;
+
+// Main loop timing, summarised into loop_stats every LOOP_STATS_INTERVAL_SEC
+struct LoopStatsStruct {
+  unsigned long passes;
+  unsigned long total_us;
+  unsigned long max_us;
+  unsigned long max_gap_us;
+  unsigned long drained;
+  unsigned long budget_hits;
+} loop_window = {};
+char loop_stats[LOOP_STATS_SIZE] = "";
+
+// Request scratch memory
+char request_arena_buffer[REQUEST_ARENA_SIZE];
+int request_arena_peak = 0;
+Arena request_arena(request_arena_buffer, REQUEST_ARENA_SIZE, reportArenaOverflow);
 
 // Socket Servers
 UDP udp;
 TCPServer server = TCPServer(web_port);
 
+// Outbound requests to the peer Fauxmo
+HttpClient peer_client(handlePeerResponse);
+
 // -------------------------------------------------------------- EEPROM Storage
 #define CONFIG_VERSION "st1"
 #define CONFIG_START 0
@@ -193,6 +345,55 @@ bool isOnTimestampRecent() {
   }
 }
 
+// ------------------------------------------------------------- EEPROM Protocol
+void writeProtocolMode(int mode) {
+  EEPROM.put(PROTOCOL_MEMORY_ADDRESS, mode);
+}
+
+int readProtocolMode() {
+  int mode = PROTOCOL_MODE;
+  EEPROM.get(PROTOCOL_MEMORY_ADDRESS, mode);
+  // Erased EEPROM reads back as all ones, fall back to the build default
+  if (mode != PROTOCOL_WEMO && mode != PROTOCOL_HUE) mode = PROTOCOL_MODE;
+  return mode;
+}
+
+
+// ------------------------------------------------------- EEPROM Cache Interval
+void writeCacheInterval(int seconds) {
+  EEPROM.put(CACHE_INTERVAL_MEMORY_ADDRESS, seconds);
+}
+
+int readCacheInterval() {
+  int seconds = CACHE_INTERVAL;
+  EEPROM.get(CACHE_INTERVAL_MEMORY_ADDRESS, seconds);
+  // Erased EEPROM reads back as all ones, fall back to the build default
+  if (seconds < CACHE_INTERVAL_MIN_SEC || seconds > CACHE_INTERVAL_MAX_SEC) {
+    seconds = CACHE_INTERVAL;
+  }
+  return seconds;
+}
+
+
+// ----------------------------------------------------------------- EEPROM Peer
+// Address of the peer Fauxmo, a zero port means no peer is configured
+struct PeerStruct {
+  uint8_t address[4];
+  uint16_t port;
+};
+
+void writePeer(const PeerStruct& peer) {
+  EEPROM.put(PEER_MEMORY_ADDRESS, peer);
+}
+
+PeerStruct readPeer() {
+  PeerStruct peer;
+  EEPROM.get(PEER_MEMORY_ADDRESS, peer);
+  // Erased EEPROM reads back as all ones
+  if (peer.port == 0xFFFF) peer.port = 0;
+  return peer;
+}
+
 
 // ------------------------------------------------------------ Helper Functions
 void debug(std::string message) {
@@ -202,29 +403,105 @@ void debug(std::string message) {
   }
 }
 
-std::string getTimestamp() {
-  return std::string(Time.format(Time.now(), "%a, %d %b %Y %H:%M:%S %Z"));
+void reportArenaOverflow (const Arena& arena) {
+  std::stringstream ss;
+  ss << "Request arena overflow: " << arena.overflowCount() << " allocations, ";
+  ss << arena.overflowBytes() << " bytes spilled to heap, peak ";
+  ss << arena.highWater() << " of " << arena.size() << " bytes";
+  debug(ss.str());
 }
 
-// Kudos: http://stackoverflow.com/a/27658515
-std::string replaceAll(
-  const std::string& str,
-  const std::string& find,
-  const std::string& replace
+template <typename T>
+ArenaString toArenaString(const T& value) {
+  ArenaStringStream ss;
+  ss << std::dec << value;
+  return ss.str();
+}
+
+ArenaString getTimestamp() {
+  return ArenaString(Time.format(Time.now(), "%a, %d %b %Y %H:%M:%S %Z"));
+}
+
+// Lets renderTemplate take literals, std::string and ArenaString alike
+struct StringRef {
+  const char* data;
+  size_t size;
+
+  StringRef(const char* str) : data(str), size(strlen(str)) {}
+  template <typename Alloc>
+  StringRef(const std::basic_string<char, std::char_traits<char>, Alloc>& str)
+    : data(str.data()), size(str.size()) {}
+};
+
+// A {{NAME}} placeholder and the text that replaces it
+struct TemplateField {
+  const char* name;
+  StringRef value;
+};
+
+const TemplateField* findTemplateField(
+  const char* name,
+  size_t size,
+  const TemplateField fields[],
+  size_t field_count
+) {
+  for (size_t i = 0; i < field_count; i++) {
+    if (strlen(fields[i].name) == size && memcmp(fields[i].name, name, size) == 0) {
+      return &fields[i];
+    }
+  }
+  return NULL;
+}
+
+// Fill every known placeholder in one pass. The first pass only measures, so
+// the result is reserved once and an ArenaString takes a single arena block.
+// Unknown placeholders are copied through untouched.
+template <typename String>
+String renderTemplate(
+  StringRef source,
+  const TemplateField fields[],
+  size_t field_count
 ) {
-  using namespace std;
-  std::string result;
-  size_t find_len = find.size();
-  size_t pos,from=0;
-  while (std::string::npos != (pos=str.find(find,from))) {
-    result.append(str, from, pos-from);
-    result.append(replace);
-    from = pos + find_len;
-  }
-  result.append(str, from, std::string::npos);
+  String result;
+  for (int pass = 0; pass < 2; pass++) {
+    size_t length = 0;
+    size_t literal = 0;
+    size_t pos = 0;
+    while (pos + 1 < source.size) {
+      if (source.data[pos] != '{' || source.data[pos + 1] != '{') {
+        pos++;
+        continue;
+      }
+      size_t end = pos + 2;
+      while (end + 1 < source.size && (source.data[end] != '}' || source.data[end + 1] != '}')) end++;
+      if (end + 1 >= source.size) break;
+
+      const TemplateField* field =
+        findTemplateField(source.data + pos + 2, end - pos - 2, fields, field_count);
+      if (field == NULL) {
+        pos = end + 2;
+        continue;
+      }
+      if (pass == 0) {
+        length += pos - literal + field->value.size;
+      } else {
+        result.append(source.data + literal, pos - literal);
+        result.append(field->value.data, field->value.size);
+      }
+      pos = end + 2;
+      literal = pos;
+    }
+    if (pass == 0) {
+      result.reserve(length + source.size - literal);
+    } else {
+      result.append(source.data + literal, source.size - literal);
+    }
+  }
   return result;
 }
 
+#define TEMPLATE_FIELDS(fields) fields, sizeof(fields) / sizeof(fields[0])
+
 void toUnsignedString(char dest[], int offset, int len, long i, int shift) {
   int char_pos = len;
   int radix = 1 << shift;
@@ -287,22 +564,33 @@ void sendSearchReply() {
   char ip_string[24];
   sprintf(ip_string, "%d.%d.%d.%d", ip_address[0], ip_address[1], ip_address[2], ip_address[3]);
 
-  std::string wemo_reply;
-  wemo_reply = replaceAll(wemo_reply_template, "{{CACHE_INTERVAL}}", TO_STRING(cache_interval));
-  wemo_reply = replaceAll(wemo_reply, "{{TIMESTAMP}}", getTimestamp());
-  wemo_reply = replaceAll(wemo_reply, "{{IP_ADDRESS}}", ip_string);
-  wemo_reply = replaceAll(wemo_reply, "{{WEB_PORT}}", TO_STRING(web_port));
-  wemo_reply = replaceAll(wemo_reply, "{{UUID}}", device_uuid);
-  wemo_reply = replaceAll(wemo_reply, "{{SERIAL_NUMBER}}", device_serial);
-
-  udp.write(wemo_reply.c_str());
+  const std::string& reply_template =
+    protocol_mode == PROTOCOL_HUE ? hue_reply_template : wemo_reply_template;
+
+  const ArenaString max_age = TO_STRING(cache_interval);
+  const ArenaString timestamp = getTimestamp();
+  const ArenaString port = TO_STRING(web_port);
+  const TemplateField fields[] = {
+    { "CACHE_INTERVAL", max_age },
+    { "TIMESTAMP", timestamp },
+    { "IP_ADDRESS", ip_string },
+    { "WEB_PORT", port },
+    { "UUID", device_uuid },
+    { "SERIAL_NUMBER", device_serial },
+    { "BRIDGE_ID", hue_bridge_id }
+  };
+  ArenaString reply = renderTemplate<ArenaString>(reply_template, TEMPLATE_FIELDS(fields));
+
+  udp.write(reply.c_str());
   udp.endPacket();
 }
 
-void handleMulticastRequest() {
+// Returns true when a packet was read, so the caller knows to try for another
+bool handleMulticastRequest() {
+  ArenaScope arena_scope(request_arena);
   int byte_count = udp.parsePacket();
   bool send_reply = false;
-  std::stringstream buffer;
+  ArenaString data;
 
   if ( byte_count > 0 ) {
     debug("Reading UPnP data from multicast group");
@@ -310,10 +598,11 @@ void handleMulticastRequest() {
     char this_char;
     int newline_count = 0;
     int counter = 0;
+    data.reserve(byte_count);
     while (newline_count < 2 && counter < byte_count) {
       this_char = udp.read();
       // Serial.print(this_char);
-      buffer << this_char;
+      data += this_char;
 
       if (this_char == '\r') continue;
 
@@ -326,81 +615,388 @@ void handleMulticastRequest() {
     }
 
     // Find the stuff we care about
-    const std::string data = buffer.str();
-    if (data.find(upnp_search) != std::string::npos &&
-        data.find(wemo_search) != std::string::npos) {
+    const std::string& search =
+      protocol_mode == PROTOCOL_HUE ? hue_search : wemo_search;
+    if (data.find(upnp_search.c_str()) != ArenaString::npos &&
+        data.find(search.c_str()) != ArenaString::npos) {
       send_reply = true;
     }
   }
 
   udp.flush();
   if (send_reply) sendSearchReply();
+  return byte_count > 0;
 }
 
-void sendMulticastNotify() {
-  if (strcmp(config.device_name, DEVICE_NAME) == 0) return;
-
-  debug("Sending UPnP Notify to multicast group");
-  udp.beginPacket(upnp_address, upnp_port);
+// Unnamed devices stay off the network until given a name from the cloud
+bool isAdvertised() {
+  return strcmp(config.device_name, DEVICE_NAME) != 0;
+}
 
+// Render the rootdevice, uuid and device type variants of both alive and
+// byebye. Must be re-run whenever the IP, serial, protocol or max-age changes.
+void renderNotifyBatches() {
   char ip_string[24];
   sprintf(ip_string, "%d.%d.%d.%d", ip_address[0], ip_address[1], ip_address[2], ip_address[3]);
 
-  std::string wemo_notify;
-  wemo_notify = replaceAll(wemo_notify_template, "{{CACHE_INTERVAL}}", TO_STRING(cache_interval));
-  wemo_notify = replaceAll(wemo_notify, "{{IP_ADDRESS}}", ip_string);
-  wemo_notify = replaceAll(wemo_notify, "{{WEB_PORT}}", TO_STRING(web_port));
-  wemo_notify = replaceAll(wemo_notify, "{{SERIAL_NUMBER}}", device_serial);
+  const bool hue = protocol_mode == PROTOCOL_HUE;
+  const std::string udn = hue ? "uuid:" + device_uuid : "uuid:Socket-1_0-" + device_serial;
+  const std::string& type = hue ? hue_device_type : device_type;
+  const std::string variants[][2] = {
+    { "upnp:rootdevice", udn + "::upnp:rootdevice" },
+    { udn, udn },
+    { type, udn + "::" + type }
+  };
+
+  const ArenaString max_age = TO_STRING(cache_interval);
+  const ArenaString port = TO_STRING(web_port);
+  const std::string bridge_header = hue ? "hue-bridgeid: " + hue_bridge_id + "\r\n" : "";
+
+  notify_alive_batch.clear();
+  notify_byebye_batch.clear();
+  for (unsigned int i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+    const TemplateField fields[] = {
+      { "CACHE_INTERVAL", max_age },
+      { "IP_ADDRESS", ip_string },
+      { "WEB_PORT", port },
+      { "DESCRIPTION_PATH", hue ? "/description.xml" : "/setup.xml" },
+      { "SERVER", hue ? hue_server : wemo_server },
+      { "BRIDGE_HEADER", bridge_header },
+      { "NOTIFY_TYPE", variants[i][0] },
+      { "UNIQUE_NAME", variants[i][1] }
+    };
+    notify_alive_batch.push_back(
+      renderTemplate<std::string>(notify_template, TEMPLATE_FIELDS(fields)));
+    notify_byebye_batch.push_back(
+      renderTemplate<std::string>(byebye_template, TEMPLATE_FIELDS(fields)));
+  }
+}
 
-  udp.write(wemo_notify.c_str());
-  udp.endPacket();
+void sendNotifyBatch(const std::vector<std::string>& packets) {
+  for (unsigned int i = 0; i < packets.size(); i++) {
+    udp.beginPacket(upnp_address, upnp_port);
+    udp.write(packets[i].c_str());
+    udp.endPacket();
+  }
+}
+
+// At most one alive burst is pending: a newer one replaces it in place, so
+// repeated changes cannot grow the queue. Byebye clears the queue first, which
+// leaves at most a byebye followed by an alive.
+void queueNotifyBurst(bool alive, const std::vector<std::string>& packets) {
+  NotifyBurst burst = { alive, packets, NOTIFY_BURST_REPEAT, millis() };
+  for (unsigned int i = 0; alive && i < notify_queue.size(); i++) {
+    if (notify_queue[i].alive) {
+      notify_queue[i] = burst;
+      return;
+    }
+  }
+  notify_queue.push_back(burst);
+}
+
+void sendMulticastNotify() {
+  if (!isAdvertised()) return;
+
+  debug("Queueing UPnP Notify to multicast group");
+  queueNotifyBurst(true, notify_alive_batch);
+}
+
+void sendMulticastByebye() {
+  if (!isAdvertised()) return;
+
+  debug("Queueing UPnP Byebye to multicast group");
+  // Anything still queued describes the identity we are withdrawing
+  notify_queue.clear();
+  queueNotifyBurst(false, notify_byebye_batch);
+}
+
+// Send at most one batch per call so repeats are spaced out across loop passes
+void serviceNotifyQueue() {
+  if (notify_queue.empty()) return;
+
+  NotifyBurst& burst = notify_queue.front();
+  if ((long) (millis() - burst.next_send_ms) < 0) return;
+
+  sendNotifyBatch(burst.packets);
+  burst.next_send_ms = millis() + NOTIFY_BURST_SPACING_MS;
+  if (--burst.repeats_left <= 0) notify_queue.erase(notify_queue.begin());
 }
 
 // --------------------------------------------------------------- HTTP Handlers
-void handleWebRequest() {
+void writeHueLight(JsonWriter& json) {
+  json.beginObject();
+  json.key("state");
+  json.beginObject();
+  json.key("on"); json.value(device_state == 1);
+  json.key("bri"); json.value(254);
+  json.key("alert"); json.value("none");
+  json.key("mode"); json.value("homeautomation");
+  json.key("reachable"); json.value(true);
+  json.endObject();
+  json.key("type"); json.value("Dimmable light");
+  json.key("name"); json.value(config.device_name);
+  json.key("modelid"); json.value("LWB010");
+  json.key("manufacturername"); json.value("Philips");
+  json.key("uniqueid"); json.value(hue_unique_id.c_str());
+  json.key("swversion"); json.value("1.15.0_r18729");
+  json.endObject();
+}
+
+// Every device lives in this one document, so a single GET covers both
+// discovery and state for all of them
+void writeHueLights(JsonWriter& json) {
+  json.beginObject();
+  json.key(HUE_LIGHT_ID);
+  writeHueLight(json);
+  json.endObject();
+}
+
+void writeHueBridge(JsonWriter& json) {
+  json.beginObject();
+  json.key("lights");
+  writeHueLights(json);
+  json.endObject();
+}
+
+void writeHueRegistration(JsonWriter& json) {
+  json.beginArray();
+  json.beginObject();
+  json.key("success");
+  json.beginObject();
+  json.key("username"); json.value(device_serial.c_str());
+  json.endObject();
+  json.endObject();
+  json.endArray();
+}
+
+// Only keys that were actually applied are echoed back; the device has no
+// dimmer, so a brightness-only change yields an empty list
+struct HueStateChange {
+  bool on_applied;
+
+  void operator()(JsonWriter& json) const {
+    json.beginArray();
+    if (on_applied) {
+      json.beginObject();
+      json.key("success");
+      json.beginObject();
+      json.key("/lights/" HUE_LIGHT_ID "/state/on"); json.value(device_state == 1);
+      json.endObject();
+      json.endObject();
+    }
+    json.endArray();
+  }
+};
+
+// Render once to measure, then again straight into the client. The render
+// step is a function, or a functor when it needs per-request values.
+template <typename Render>
+void sendHueJson(TCPClient& client, const Render& render) {
+  JsonWriter counter(NULL);
+  render(counter);
+
+  const ArenaString timestamp = getTimestamp();
+  const ArenaString content_length = TO_STRING(counter.finish());
+  const TemplateField fields[] = {
+    { "TIMESTAMP", timestamp },
+    { "CONTENT_LENGTH", content_length }
+  };
+  ArenaString header = renderTemplate<ArenaString>(json_header_template, TEMPLATE_FIELDS(fields));
+  client.write((const uint8_t*) header.c_str(), header.length());
+
+  JsonWriter writer(&client);
+  render(writer);
+  writer.finish();
+}
+
+// Value of the "on" key in the request body: 1, 0, or -1 when it is absent
+int getHueStateOn(const ArenaString& request) {
+  size_t pos = request.find("\r\n\r\n");
+  if (pos == ArenaString::npos) return -1;
+  pos = request.find("\"on\"", pos);
+  if (pos == ArenaString::npos) return -1;
+  pos = request.find_first_not_of(" \t:", pos + 4);
+  if (pos == ArenaString::npos) return -1;
+  if (request.compare(pos, 4, "true") == 0) return 1;
+  if (request.compare(pos, 5, "false") == 0) return 0;
+  return -1;
+}
+
+void handleHueRequest(TCPClient& client, const ArenaString& request) {
+  // Request line is "<METHOD> <PATH> HTTP/1.1"
+  size_t path_start = request.find(' ') + 1;
+  size_t path_end = request.find(' ', path_start);
+  const ArenaString path = request.substr(path_start, path_end - path_start);
+
+  if (request.find(hue_description_request.c_str()) == 0) {
+    debug("Sending Hue bridge description");
+    char ip_string[24];
+    sprintf(ip_string, "%d.%d.%d.%d", ip_address[0], ip_address[1], ip_address[2], ip_address[3]);
+
+    const ArenaString port = TO_STRING(web_port);
+    const TemplateField xml_fields[] = {
+      { "DEVICE_NAME", config.device_name },
+      { "IP_ADDRESS", ip_string },
+      { "WEB_PORT", port },
+      { "SERIAL_NUMBER", device_serial },
+      { "UUID", device_uuid }
+    };
+    const ArenaString xml =
+      renderTemplate<ArenaString>(hue_description_template, TEMPLATE_FIELDS(xml_fields));
+
+    const ArenaString timestamp = getTimestamp();
+    const ArenaString content_length = TO_STRING(xml.length());
+    const TemplateField fields[] = {
+      { "TIMESTAMP", timestamp },
+      { "CONTENT_LENGTH", content_length },
+      { "XML_RESPONSE", xml }
+    };
+    ArenaString response = renderTemplate<ArenaString>(setup_header_template, TEMPLATE_FIELDS(fields));
+    client.write((const uint8_t*) response.c_str(), response.length());
+  } else if (request.find(hue_register_request.c_str()) == 0) {
+    debug("Accepting Hue user registration");
+    sendHueJson(client, writeHueRegistration);
+  } else if (request.find(hue_state_request.c_str()) == 0 &&
+             path.find("/lights/" HUE_LIGHT_ID "/state") != ArenaString::npos) {
+    int on = getHueStateOn(request);
+    if (on == 1) {
+      turnDeviceOn();
+    } else if (on == 0) {
+      turnDeviceOff();
+    }
+    HueStateChange change = { on != -1 };
+    sendHueJson(client, change);
+  } else if (request.find(hue_lights_request.c_str()) == 0) {
+    debug("Sending Hue lights document");
+    if (path.find("/lights/" HUE_LIGHT_ID) != ArenaString::npos) {
+      sendHueJson(client, writeHueLight);
+    } else if (path.find("/lights") != ArenaString::npos) {
+      sendHueJson(client, writeHueLights);
+    } else {
+      sendHueJson(client, writeHueBridge);
+    }
+  } else {
+    debug("Sending 404 reponse for unknown request");
+    client.write((const uint8_t*) four_oh_four.c_str(), four_oh_four.length());
+  }
+}
+
+// Returns true when a client was served, so the caller knows to try for another
+bool handleWebRequest() {
   TCPClient client = server.available();
-  if (!client.connected()) return;
+  if (!client.connected()) return false;
 
+  ArenaScope arena_scope(request_arena);
   int counter = 0;
-  std::stringstream buffer;
+  ArenaString request;
+  ArenaString response;
+  request.reserve(WEB_EXPECTED_REQUEST_SIZE);
 
   // Now actually read this into a string, check for the path params for
   debug("Reading TCP data on HTTP control port");
   char this_char;
   while (client.available() && counter < WEB_EXPECTED_REQUEST_SIZE) {
     this_char = client.read();
-    buffer << this_char;
+    request += this_char;
     counter++;
   }
 
-  std::string request = buffer.str();
-  std::string response;
+  if (protocol_mode == PROTOCOL_HUE) {
+    handleHueRequest(client, request);
+    client.flush();
+    client.stop();
+    return true;
+  }
 
-  if (request.find(setup_request) != std::string::npos) {
+  if (request.find(setup_request.c_str()) != ArenaString::npos) {
     debug("Sending XML setup document");
     // the config XML file and the control calls, then return the appropriate
     // template or control what needs to be controlled.
-    std::string xml = replaceAll(setup_xml_template, "{{DEVICE_NAME}}", std::string(config.device_name));
-    xml = replaceAll(xml, "{{SERIAL_NUMBER}}", device_serial);
-
-    response = replaceAll(setup_header_template, "{{TIMESTAMP}}", getTimestamp());
-    response = replaceAll(response, "{{CONTENT_LENGTH}}", TO_STRING(xml.length()));
-    response = replaceAll(response, "{{XML_RESPONSE}}", xml);
-  } else if (request.find(control_request) != std::string::npos) {
-    if (request.find(turn_on_state) != std::string::npos) {
+    const TemplateField xml_fields[] = {
+      { "DEVICE_NAME", config.device_name },
+      { "DEVICE_TYPE", device_type },
+      { "SERIAL_NUMBER", device_serial }
+    };
+    const ArenaString xml =
+      renderTemplate<ArenaString>(setup_xml_template, TEMPLATE_FIELDS(xml_fields));
+
+    const ArenaString timestamp = getTimestamp();
+    const ArenaString content_length = TO_STRING(xml.length());
+    const TemplateField fields[] = {
+      { "TIMESTAMP", timestamp },
+      { "CONTENT_LENGTH", content_length },
+      { "XML_RESPONSE", xml }
+    };
+    response = renderTemplate<ArenaString>(setup_header_template, TEMPLATE_FIELDS(fields));
+  } else if (request.find(control_request.c_str()) != ArenaString::npos) {
+    if (request.find(turn_on_state.c_str()) != ArenaString::npos) {
       turnDeviceOn();
     } else {
       turnDeviceOff();
     }
-    response = replaceAll(control_response_template, "{{TIMESTAMP}}", getTimestamp());
+    const ArenaString timestamp = getTimestamp();
+    const TemplateField fields[] = {
+      { "TIMESTAMP", timestamp }
+    };
+    response = renderTemplate<ArenaString>(control_response_template, TEMPLATE_FIELDS(fields));
   } else {
     debug("Sending 404 reponse for unknown request");
-    response = four_oh_four;
+    response.assign(four_oh_four.data(), four_oh_four.size());
   }
 
   server.write((unsigned char*) response.c_str(), response.length());
   client.flush();
   client.stop();
+  return true;
+}
+
+
+// ------------------------------------------------------ Peer Control Functions
+// Returns true only if the request was queued
+bool sendPeerState(int state) {
+  PeerStruct peer = readPeer();
+  if (peer.port == 0) {
+    debug("No peer configured, ignoring peer switch");
+    return false;
+  }
+
+  char peer_address[24];
+  sprintf(peer_address, "%d.%d.%d.%d:%d", peer.address[0], peer.address[1], peer.address[2], peer.address[3], peer.port);
+
+  const ArenaString binary_state = TO_STRING(state);
+  const TemplateField body_fields[] = {
+    { "BINARY_STATE", binary_state }
+  };
+  const std::string body =
+    renderTemplate<std::string>(peer_control_body_template, TEMPLATE_FIELDS(body_fields));
+
+  const ArenaString content_length = TO_STRING(body.length());
+  const TemplateField fields[] = {
+    { "PEER_ADDRESS", peer_address },
+    { "CONTENT_LENGTH", content_length },
+    { "SOAP_BODY", body }
+  };
+  const std::string request = renderTemplate<std::string>(peer_control_template, TEMPLATE_FIELDS(fields));
+
+  IPAddress host(peer.address[0], peer.address[1], peer.address[2], peer.address[3]);
+  if (!peer_client.enqueue(host, peer.port, request, state)) {
+    debug("Peer unreachable or request queue full, dropping peer switch");
+    return false;
+  }
+  return true;
+}
+
+// The tag carries the state that was requested. The peer state is updated
+// optimistically on press, so only a failure needs to touch it here.
+void handlePeerResponse (const HttpRequest& request, int status) {
+  std::stringstream ss;
+  if (status == 200) {
+    ss << "Peer set to " << (request.tag == 1 ? "ON" : "OFF");
+  } else {
+    ss << "Peer request failed with status " << status;
+    if (peer_state == request.tag) peer_state = request.tag == 1 ? 0 : 1;
+  }
+  debug(ss.str());
 }
 
 
@@ -414,6 +1010,23 @@ std::string getDeviceSerial() {
   return ss.str();
 }
 
+// Hue bridge IDs splice FFFE into the middle of the MAC address
+std::string getHueBridgeId() {
+  byte mac[6];
+  WiFi.macAddress(mac);
+  char bridge_id[17];
+  sprintf(bridge_id, "%02X%02X%02XFFFE%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  return std::string(bridge_id);
+}
+
+std::string getHueUniqueId() {
+  byte mac[6];
+  WiFi.macAddress(mac);
+  char unique_id[27];
+  sprintf(unique_id, "%02x:%02x:%02x:%02x:%02x:%02x:00:11-0b", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  return std::string(unique_id);
+}
+
 std::string getDeviceUUID() {
   if (config.device_uuid[0] >= '0' && config.device_uuid[0] <= 'f') {
     // Already have the UUID saved
@@ -436,6 +1049,9 @@ std::string getDeviceUUID() {
 
 // ---------------------------------------------------- Particle Cloud Functions
 int call_setDeviceName(String name) {
+    // Withdraw the old name before announcing the new one
+    sendMulticastByebye();
+
     //update new value to eeprom
     name.toCharArray(config.device_name, DEVICE_NAME_SIZE);
     saveConfig();
@@ -448,6 +1064,9 @@ int call_setDeviceName(String name) {
     ss << ", UUID: " << config.device_uuid;
     debug(ss.str());
 
+    renderNotifyBatches();
+    sendMulticastNotify();
+
     return 1;
 }
 
@@ -465,6 +1084,86 @@ int call_setDeviceState(String state) {
   return 1;
 }
 
+int call_setCacheMaxAge(String max_age) {
+  int seconds = max_age.toInt();
+  // The re-advertise timer works in milliseconds, keep it inside 32 bits
+  if (seconds < CACHE_INTERVAL_MIN_SEC || seconds > CACHE_INTERVAL_MAX_SEC) {
+    std::stringstream ss;
+    ss << "Cache max-age must be between " << CACHE_INTERVAL_MIN_SEC;
+    ss << " and " << CACHE_INTERVAL_MAX_SEC << " seconds";
+    debug(ss.str());
+    return -1;
+  }
+
+  cache_interval = seconds;
+  writeCacheInterval(cache_interval);
+  renderNotifyBatches();
+  sendMulticastNotify();
+  return cache_interval;
+}
+
+
+int call_setProtocol(String protocol) {
+  int mode;
+  if (protocol == "wemo") {
+    mode = PROTOCOL_WEMO;
+  } else if (protocol == "hue") {
+    mode = PROTOCOL_HUE;
+  } else {
+    std::stringstream ss;
+    ss << "Unknown protocol: " << protocol;
+    debug(ss.str());
+    return -1;
+  }
+
+  if (mode != protocol_mode) {
+    // Withdraw the old device description before announcing the new one
+    sendMulticastByebye();
+    protocol_mode = mode;
+    writeProtocolMode(protocol_mode);
+    renderNotifyBatches();
+    sendMulticastNotify();
+  }
+  return protocol_mode;
+}
+
+
+bool isOctet(int value) {
+  return value >= 0 && value <= 255;
+}
+
+// Accepts "a.b.c.d:port", or an empty string to forget the peer
+int call_setPeer(String address) {
+  PeerStruct peer = {};
+  int a, b, c, d, port;
+  if (address.length() > 0) {
+    if (sscanf(address.c_str(), "%d.%d.%d.%d:%d", &a, &b, &c, &d, &port) != 5 ||
+        !isOctet(a) || !isOctet(b) || !isOctet(c) || !isOctet(d) ||
+        port <= 0 || port >= 0xFFFF) {
+      std::stringstream ss;
+      ss << "Invalid peer address: " << address;
+      debug(ss.str());
+      return -1;
+    }
+    peer.address[0] = a;
+    peer.address[1] = b;
+    peer.address[2] = c;
+    peer.address[3] = d;
+    peer.port = port;
+  }
+
+  writePeer(peer);
+  peer_state = 0;
+  return 1;
+}
+
+
+// --------------------------------------------------------------- System Events
+void handleSystemReset(system_event_t event, int param) {
+  // No loop passes left to pace a burst, send a single byebye batch right now
+  if (isAdvertised()) sendNotifyBatch(notify_byebye_batch);
+}
+
 
 // ------------------------------------------------------------- Setup Functions
 void setup() {
@@ -476,18 +1175,32 @@ void setup() {
   Particle.function("deviceState", call_setDeviceState);
   Particle.variable("deviceName", config.device_name, STRING);
   Particle.function("deviceName", call_setDeviceName);
+  Particle.variable("cacheMaxAge", cache_interval);
+  Particle.function("cacheMaxAge", call_setCacheMaxAge);
+  Particle.variable("protocol", protocol_mode);
+  Particle.function("protocol", call_setProtocol);
+  Particle.variable("peerState", peer_state);
+  Particle.variable("loopStats", loop_stats, STRING);
+  Particle.variable("arenaPeak", request_arena_peak);
+  Particle.function("peer", call_setPeer);
 
   //load config
   loadConfig();
+  protocol_mode = readProtocolMode();
+  cache_interval = readCacheInterval();
 
   pinMode(status_led, OUTPUT);
   pinMode(device_out, OUTPUT);
   pinMode(control_in, INPUT_PULLDOWN);
   attachInterrupt(control_in, buttonPressInterrupt, FALLING);
+  pinMode(peer_control_in, INPUT_PULLDOWN);
+  attachInterrupt(peer_control_in, peerButtonPressInterrupt, FALLING);
 
   // Generate device values
   device_uuid = getDeviceUUID();
   device_serial = getDeviceSerial();
+  hue_bridge_id = getHueBridgeId();
+  hue_unique_id = getHueUniqueId();
 
   // Wait for wireless to come online
   waitUntil(WiFi.ready);
@@ -508,8 +1221,10 @@ void setup() {
   // Start TCP
   server.begin();
 
-  // Let the network know we're here
+  // Let the network know we're here, and when we leave
+  renderNotifyBatches();
   sendMulticastNotify();
+  System.on(reset, handleSystemReset);
 
   // Check if device was recently on before losing power
   if (isOnTimestampRecent()) {
@@ -518,14 +1233,82 @@ void setup() {
 }
 
 
+// ------------------------------------------------------------------- Scheduler
+// Time from start_us to end_us, allowing for micros() having wrapped once
+unsigned long microsBetween(unsigned long start_us, unsigned long end_us) {
+  if (end_us < start_us) return end_us + MICROS_ROLLOVER - start_us;
+  return end_us - start_us;
+}
+
+// Local switches always go first, and are checked again between network items
+void checkUrgentInputs() {
+  checkButtonPress();
+  checkPeerButtonPress();
+}
+
+// Drain queued packets and connections until both are empty, the item cap is
+// reached or the time budget runs out. Anything left waits for the next pass.
+void serviceNetwork() {
+  unsigned long start_us = micros();
+
+  for (int i = 0; i < LOOP_DRAIN_MAX_ITEMS; i++) {
+    bool busy = false;
+    if (handleMulticastRequest()) {
+      busy = true;
+      loop_window.drained++;
+    }
+    if (handleWebRequest()) {
+      busy = true;
+      loop_window.drained++;
+    }
+    checkUrgentInputs();
+
+    if (!busy) return;
+    if (microsBetween(start_us, micros()) > LOOP_DRAIN_BUDGET_US) {
+      loop_window.budget_hits++;
+      return;
+    }
+  }
+}
+
+// The gap is time spent outside loop(), mostly Particle system housekeeping.
+// A pass where micros() wrapped is left out rather than guessed at.
+void recordLoopPass(unsigned long previous_end_us, unsigned long start_us, unsigned long end_us) {
+  static unsigned long window_start = millis();
+
+  if (previous_end_us <= start_us && start_us <= end_us) {
+    unsigned long gap_us = start_us - previous_end_us;
+    unsigned long pass_us = end_us - start_us;
+    loop_window.passes++;
+    loop_window.total_us += pass_us;
+    if (pass_us > loop_window.max_us) loop_window.max_us = pass_us;
+    if (gap_us > loop_window.max_gap_us) loop_window.max_gap_us = gap_us;
+  }
+
+  if (millis() - window_start > 1000 * LOOP_STATS_INTERVAL_SEC && loop_window.passes > 0) {
+    snprintf(loop_stats, LOOP_STATS_SIZE,
+      "passes=%lu avg_us=%lu max_us=%lu max_gap_us=%lu drained=%lu budget_hits=%lu",
+      loop_window.passes, loop_window.total_us / loop_window.passes,
+      loop_window.max_us, loop_window.max_gap_us,
+      loop_window.drained, loop_window.budget_hits);
+    loop_window = LoopStatsStruct();
+    window_start = millis();
+  }
+}
+
+
 // ------------------------------------------------------------- Main Event Loop
 void loop() {
   static unsigned long time_on_update_timer = millis();
   static unsigned long notify_update_timer = millis();
+  static unsigned long loop_end_us = micros();
+  unsigned long loop_start_us = micros();
 
-  handleMulticastRequest();
-  handleWebRequest();
-  checkButtonPress();
+  checkUrgentInputs();
+  serviceNetwork();
+  peer_client.process();
+  serviceNotifyQueue();
+  request_arena_peak = request_arena.highWater();
 
   if (millis() - time_on_update_timer > 1000 * ON_TIME_UPDATE_INTERVAL_SEC) {
     if (device_state == 1) {
@@ -534,10 +1317,24 @@ void loop() {
     time_on_update_timer = millis();
   }
 
-  if (millis() - notify_update_timer > 1000 * NOTIFY_UPDATE_INTERVAL_SEC) {
+  // While WiFi is down localIP() reads 0.0.0.0, which is not a new address
+  IPAddress current_ip = WiFi.ready() ? WiFi.localIP() : ip_address;
+  if (current_ip[0] != 0 && current_ip != ip_address) {
+    // Reconfigured onto a new address, the old LOCATION is no longer valid
+    sendMulticastByebye();
+    ip_address = current_ip;
+    renderNotifyBatches();
+    sendMulticastNotify();
+  }
+
+  if (millis() - notify_update_timer > 500UL * cache_interval) {
     sendMulticastNotify();
     notify_update_timer = millis();
   }
+
+  unsigned long loop_done_us = micros();
+  recordLoopPass(loop_end_us, loop_start_us, loop_done_us);
+  loop_end_us = loop_done_us;
 }
 
 
@@ -563,3 +1360,22 @@ void checkButtonPress () {
     button_press_flag = false;
   }
 }
+
+void peerButtonPressInterrupt () {
+  static unsigned long last_interrupt_time = 0;
+  unsigned long interrupt_time = millis();
+
+  if (interrupt_time - last_interrupt_time > 50) { // debounce time = 50ms
+    peer_button_press_flag = true;
+  }
+  last_interrupt_time = interrupt_time;
+}
+
+void checkPeerButtonPress () {
+  if (peer_button_press_flag == true) {
+    debug("Peer button pressed, toggling peer state");
+    int next_state = peer_state == 0 ? 1 : 0;
+    if (sendPeerState(next_state)) peer_state = next_state;
+    peer_button_press_flag = false;
+  }
+}
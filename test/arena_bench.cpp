@@ -0,0 +1,197 @@
+//
+// arena_bench.cpp
+//
+// Host benchmark for the per-request arena. Drives the real network handlers
+// from main.cpp and counts heap traffic inside each call. `make host-bench`
+// runs it once as shipped and once built with ARENA_DISABLED for comparison.
+//
+
+#include <stdio.h>
+#include <malloc.h>
+#include <string>
+#include "application.h"
+#include "arena.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Heap accounting. The glibc entry points are wrapped so every allocation the
+// handlers make, including those inside libstdc++, is seen.
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void __libc_free(void* p);
+
+static bool counting = false;
+static unsigned long heap_calls = 0;
+static unsigned long heap_bytes = 0;
+static long live_bytes = 0;
+static long peak_live_bytes = 0;
+
+static void countAllocation(void* p)
+{
+    if (!counting || p == NULL) return;
+    size_t size = malloc_usable_size(p);
+    heap_calls++;
+    heap_bytes += size;
+    live_bytes += size;
+    if (live_bytes > peak_live_bytes) peak_live_bytes = live_bytes;
+}
+
+static void countFree(void* p)
+{
+    if (counting && p != NULL) live_bytes -= malloc_usable_size(p);
+}
+
+extern "C" void* malloc(size_t size)
+{
+    void* p = __libc_malloc(size);
+    countAllocation(p);
+    return p;
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    void* p = __libc_calloc(count, size);
+    countAllocation(p);
+    return p;
+}
+
+extern "C" void* realloc(void* p, size_t size)
+{
+    countFree(p);
+    void* q = __libc_realloc(p, size);
+    countAllocation(q);
+    return q;
+}
+
+extern "C" void free(void* p)
+{
+    countFree(p);
+    __libc_free(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Firmware under test.
+
+void setup();
+bool handleWebRequest();
+bool handleMulticastRequest();
+extern UDP udp;
+extern TCPServer server;
+extern Arena request_arena;
+extern int protocol_mode;
+extern IPAddress ip_address;
+int call_setDeviceName(String name);
+
+// Must match main.cpp
+#define DEVICE_NAME_SIZE 65
+
+#define BENCH_ITERATIONS 1000
+
+struct Scenario
+{
+    const char* name;
+    int protocol;
+    bool multicast;
+    const char* request;
+};
+
+static const Scenario scenarios[] = {
+    { "wemo setup.xml", 0, false,
+      "GET /setup.xml HTTP/1.1\r\nHost: 10.0.0.2:49153\r\n\r\n" },
+    { "wemo control", 0, false,
+      "POST /upnp/control/basicevent1 HTTP/1.1\r\n"
+      "SOAPACTION: \"urn:Belkin:service:basicevent:1#SetBinaryState\"\r\n\r\n"
+      "<BinaryState>1</BinaryState>" },
+    { "wemo M-SEARCH", 0, true,
+      "M-SEARCH * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nMAN: \"ssdp:discover\"\r\n"
+      "MX: 15\r\nST: urn:Belkin:device:**\r\n\r\n" },
+    { "hue M-SEARCH", 1, true,
+      "M-SEARCH * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nMAN: \"ssdp:discover\"\r\n"
+      "MX: 15\r\nST: urn:schemas-upnp-org:device:basic:1\r\n\r\n" },
+    { "hue description", 1, false,
+      "GET /description.xml HTTP/1.1\r\nHost: 10.0.0.2:49153\r\n\r\n" },
+    { "hue lights", 1, false,
+      "GET /api/user/lights HTTP/1.1\r\nHost: 10.0.0.2:49153\r\n\r\n" },
+    { "hue state", 1, false,
+      "PUT /api/user/lights/1/state HTTP/1.1\r\nHost: 10.0.0.2:49153\r\n\r\n{\"on\":true}" },
+};
+
+// Run one scenario, returning the bytes the handler sent back.
+static size_t runOnce(const Scenario& scenario)
+{
+    int peer = -1;
+    unsigned long sent_before = udp.sent_bytes;
+    if (scenario.multicast) {
+        udp.inject(scenario.request);
+    } else {
+        peer = server.inject(scenario.request);
+    }
+
+    counting = true;
+    if (scenario.multicast) {
+        handleMulticastRequest();
+    } else {
+        handleWebRequest();
+    }
+    counting = false;
+
+    if (scenario.multicast) return udp.sent_bytes - sent_before;
+
+    size_t received = 0;
+    char buffer[1024];
+    ssize_t read;
+    while ((read = recv(peer, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) received += read;
+    close(peer);
+    return received;
+}
+
+static void runScenarios(const char* label)
+{
+    printf("\n%s\n", label);
+    printf("%-16s %12s %12s %14s %10s\n", "scenario", "allocs/req", "bytes/req", "peak live", "reply");
+
+    for (unsigned int i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        const Scenario& scenario = scenarios[i];
+        protocol_mode = scenario.protocol;
+
+        heap_calls = 0;
+        heap_bytes = 0;
+        live_bytes = 0;
+        peak_live_bytes = 0;
+        size_t reply = 0;
+        for (int n = 0; n < BENCH_ITERATIONS; n++) reply = runOnce(scenario);
+
+        printf("%-16s %12.1f %12.1f %14ld %10u\n", scenario.name,
+               (double) heap_calls / BENCH_ITERATIONS,
+               (double) heap_bytes / BENCH_ITERATIONS,
+               peak_live_bytes, (unsigned int) reply);
+    }
+
+#ifndef ARENA_DISABLED
+    printf("arena high water %u bytes\n", (unsigned int) request_arena.highWater());
+#endif
+}
+
+int main()
+{
+    setup();
+
+#ifdef ARENA_DISABLED
+    printf("arena_bench: heap only (ARENA_DISABLED), %d iterations\n", BENCH_ITERATIONS);
+#else
+    printf("arena_bench: %u byte arena, %d iterations\n", (unsigned int) request_arena.size(), BENCH_ITERATIONS);
+#endif
+
+    runScenarios("defaults");
+
+    // The longest name and address the firmware can be configured with
+    call_setDeviceName(std::string(DEVICE_NAME_SIZE - 1, 'n').c_str());
+    ip_address = IPAddress(192, 168, 100, 200);
+    runScenarios("worst case: 64 character name, 15 character address");
+
+    // Free chunks glibc is left holding: the fragmentation the run caused
+    struct mallinfo2 info = mallinfo2();
+    printf("\nheap free chunks %zu, free bytes %zu\n", info.ordblks, info.fordblks);
+    return 0;
+}
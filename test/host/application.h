@@ -0,0 +1,354 @@
+//
+// application.h
+//
+// Host build shim for the parts of the Particle API used by the firmware.
+// TCPClient is backed by real sockets so it can talk to a local stand-in
+// server. UDP and TCPServer take their traffic from inject(), so a host build
+// of main.cpp can have its handlers driven directly.
+//
+#ifndef HOST_APPLICATION_H
+#define HOST_APPLICATION_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <deque>
+#include <string>
+
+typedef uint8_t byte;
+
+inline unsigned long millis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+inline unsigned long micros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000UL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pins. All no-ops on the host.
+
+enum { D0, D1, D2, D7 };
+enum { LOW = 0, HIGH = 1 };
+enum { OUTPUT, INPUT_PULLDOWN, FALLING };
+
+inline void pinMode(int pin, int mode) {}
+inline void digitalWrite(int pin, int value) {}
+inline void attachInterrupt(int pin, void (*handler)(), int mode) {}
+
+#define waitUntil(condition) while (!condition()) {}
+
+////////////////////////////////////////////////////////////////////////////////
+// String
+
+class String
+{
+  public:
+    String(const char* text = "") : text_(text) {}
+    const char* c_str() const { return text_.c_str(); }
+    operator const char*() const { return text_.c_str(); }
+    unsigned int length() const { return text_.length(); }
+    int toInt() const { return atoi(text_.c_str()); }
+    bool operator==(const char* other) const { return text_ == other; }
+    void toCharArray(char* buffer, unsigned int size) const
+    {
+        strncpy(buffer, text_.c_str(), size);
+        if (size > 0) buffer[size - 1] = 0;
+    }
+
+  private:
+    std::string text_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Print
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IPAddress
+
+class IPAddress
+{
+  public:
+    IPAddress() { memset(octets_, 0, sizeof(octets_)); }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    {
+        octets_[0] = a; octets_[1] = b; octets_[2] = c; octets_[3] = d;
+    }
+    uint8_t operator[](int index) const { return octets_[index]; }
+    bool operator==(const IPAddress& other) const { return memcmp(octets_, other.octets_, 4) == 0; }
+    bool operator!=(const IPAddress& other) const { return !(*this == other); }
+
+  private:
+    uint8_t octets_[4];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// TCPClient
+//
+// Like the device, connect() blocks and everything else does not. The client
+// stays connected() until the peer has closed and all its data has been read.
+
+class TCPClient : public Print
+{
+  public:
+    TCPClient() : fd_(-1), peer_closed_(false) {}
+
+    // Host only: wrap an already connected descriptor
+    void adopt(int fd)
+    {
+        fd_ = fd;
+        fcntl(fd_, F_SETFL, O_NONBLOCK);
+        peer_closed_ = false;
+    }
+
+    bool connect(IPAddress ip, uint16_t port)
+    {
+        stop();
+        fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_ < 0) return false;
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        uint8_t octets[4] = { ip[0], ip[1], ip[2], ip[3] };
+        memcpy(&address.sin_addr, octets, 4);
+
+        if (::connect(fd_, (struct sockaddr*) &address, sizeof(address)) != 0) {
+            stop();
+            return false;
+        }
+        fcntl(fd_, F_SETFL, O_NONBLOCK);
+        peer_closed_ = false;
+        return true;
+    }
+
+    int available()
+    {
+        if (fd_ < 0) return 0;
+        int pending = 0;
+        ioctl(fd_, FIONREAD, &pending);
+        if (pending == 0) {
+            char c;
+            if (recv(fd_, &c, 1, MSG_PEEK) == 0) peer_closed_ = true;
+        }
+        return pending;
+    }
+
+    bool connected()
+    {
+        if (fd_ < 0) return false;
+        return available() > 0 || !peer_closed_;
+    }
+
+    int read()
+    {
+        uint8_t c;
+        return read(&c, 1) == 1 ? c : -1;
+    }
+
+    void flush() {}
+
+    int read(uint8_t* buffer, size_t size)
+    {
+        if (fd_ < 0) return -1;
+        return recv(fd_, buffer, size, 0);
+    }
+
+    size_t write(const uint8_t* buffer, size_t size)
+    {
+        if (fd_ < 0) return 0;
+        ssize_t sent = send(fd_, buffer, size, MSG_NOSIGNAL);
+        return sent < 0 ? 0 : sent;
+    }
+
+    void stop()
+    {
+        if (fd_ >= 0) close(fd_);
+        fd_ = -1;
+        peer_closed_ = false;
+    }
+
+  private:
+    int fd_;
+    bool peer_closed_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// TCPServer. Each inject() queues a client whose request is already waiting;
+// the returned descriptor is the far end, where the response can be read.
+
+class TCPServer
+{
+  public:
+    TCPServer(uint16_t port) : current_fd_(-1) {}
+    void begin() {}
+
+    int inject(const std::string& request)
+    {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        send(fds[1], request.data(), request.size(), MSG_NOSIGNAL);
+        pending_.push_back(fds[0]);
+        return fds[1];
+    }
+
+    TCPClient available()
+    {
+        TCPClient client;
+        if (pending_.empty()) return client;
+        current_fd_ = pending_.front();
+        pending_.pop_front();
+        client.adopt(current_fd_);
+        return client;
+    }
+
+    size_t write(const uint8_t* buffer, size_t size)
+    {
+        ssize_t sent = send(current_fd_, buffer, size, MSG_NOSIGNAL);
+        return sent < 0 ? 0 : sent;
+    }
+
+  private:
+    std::deque<int> pending_;
+    int current_fd_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// UDP. Sent packets are only counted.
+
+class UDP
+{
+  public:
+    UDP() : sent_packets(0), sent_bytes(0), position_(0) {}
+
+    void inject(const std::string& packet) { inbox_.push_back(packet); }
+
+    void begin(uint16_t port) {}
+    void joinMulticast(IPAddress address) {}
+
+    int parsePacket()
+    {
+        current_.clear();
+        position_ = 0;
+        if (inbox_.empty()) return 0;
+        current_.swap(inbox_.front());
+        inbox_.pop_front();
+        return current_.size();
+    }
+
+    int read() { return position_ < current_.size() ? (uint8_t) current_[position_++] : -1; }
+    void flush() { position_ = current_.size(); }
+    IPAddress remoteIP() { return IPAddress(10, 0, 0, 1); }
+    uint16_t remotePort() { return 1900; }
+
+    int beginPacket(IPAddress address, uint16_t port) { return 1; }
+    size_t write(const char* text) { sent_bytes += strlen(text); return strlen(text); }
+    int endPacket() { sent_packets++; return 1; }
+
+    unsigned long sent_packets;
+    unsigned long sent_bytes;
+
+  private:
+    std::deque<std::string> inbox_;
+    std::string current_;
+    size_t position_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Device services. Just enough state for setup() and the handlers to run.
+
+class EEPROMClass
+{
+  public:
+    EEPROMClass() { memset(data_, 0xFF, sizeof(data_)); }
+    uint8_t read(int address) { return data_[address]; }
+    void write(int address, uint8_t value) { data_[address] = value; }
+    template <typename T> void get(int address, T& value) { memcpy(&value, data_ + address, sizeof(T)); }
+    template <typename T> void put(int address, const T& value) { memcpy(data_ + address, &value, sizeof(T)); }
+
+  private:
+    uint8_t data_[2048];
+};
+static __attribute__((unused)) EEPROMClass EEPROM;
+
+class TimeClass
+{
+  public:
+    long now() { return time(NULL); }
+    String format(long timestamp, const char* format)
+    {
+        char buffer[64];
+        time_t t = timestamp;
+        strftime(buffer, sizeof(buffer), format, gmtime(&t));
+        return String(buffer);
+    }
+};
+static __attribute__((unused)) TimeClass Time;
+
+class SerialClass
+{
+  public:
+    void begin(int baud) {}
+    void println(const char* text) {}
+};
+static __attribute__((unused)) SerialClass Serial;
+
+enum { STRING };
+
+class ParticleClass
+{
+  public:
+    template <typename T> bool variable(const char* name, T& value) { return true; }
+    bool variable(const char* name, char* value, int type) { return true; }
+    bool function(const char* name, int (*handler)(String)) { return true; }
+    bool publish(const char* name, const char* data) { return true; }
+};
+static __attribute__((unused)) ParticleClass Particle;
+
+class WiFiClass
+{
+  public:
+    bool ready() { return true; }
+    IPAddress localIP() { return IPAddress(10, 0, 0, 2); }
+    void macAddress(byte* mac)
+    {
+        static const byte address[6] = { 0xe0, 0x4f, 0x43, 0x12, 0x34, 0x56 };
+        memcpy(mac, address, 6);
+    }
+};
+static __attribute__((unused)) WiFiClass WiFi;
+
+typedef int system_event_t;
+enum { reset = 1 };
+
+class SystemClass
+{
+  public:
+    void on(int events, void (*handler)(system_event_t, int)) {}
+};
+static __attribute__((unused)) SystemClass System;
+
+#endif // HOST_APPLICATION_H
@@ -0,0 +1,272 @@
+//
+// http_client_test.cpp
+//
+// Host tests for HttpClient against a local stand-in peer. Build and run with
+// `make host-test`.
+//
+
+#include <stdio.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "http_client.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Stand-in peer. Serves one connection at a time on a loopback port.
+
+enum PeerBehavior
+{
+    kKeepAlive,     // 200 with Content-Length, connection left open
+    kFauxmo,        // this firmware's reply: no header terminator, then close
+    kSilent,        // reads the request and never answers
+    kSilentOnce     // silent on the first connection, then keep-alive
+};
+
+struct StandInPeer
+{
+    PeerBehavior behavior;
+    int listen_fd;
+    uint16_t port;
+    volatile bool running;
+    volatile int accepts;
+    volatile int requests;
+    pthread_t thread;
+};
+
+static void serveConnection(StandInPeer* peer, int fd)
+{
+    bool silent = peer->behavior == kSilent ||
+                  (peer->behavior == kSilentOnce && peer->accepts == 1);
+    char buffer[1024];
+
+    while (peer->running) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 20) <= 0) continue;
+        if (recv(fd, buffer, sizeof(buffer), 0) <= 0) break;
+        peer->requests++;
+        if (silent) continue;
+
+        const char* reply = peer->behavior == kFauxmo
+            ? "HTTP/1.1 200 OK\r\nCONTENT-LENGTH: 295\r\nContent-length: 4\r\nOK\r\n"
+            : "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nOK";
+        send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+        if (peer->behavior == kFauxmo) break;
+    }
+    close(fd);
+}
+
+static void* runPeer(void* arg)
+{
+    StandInPeer* peer = static_cast<StandInPeer*>(arg);
+    while (peer->running) {
+        struct pollfd pfd = { peer->listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 20) <= 0) continue;
+        int fd = accept(peer->listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        peer->accepts++;
+        serveConnection(peer, fd);
+    }
+    return NULL;
+}
+
+// Bind an ephemeral loopback port; with start == false nothing listens on it.
+static void openPeer(StandInPeer& peer, PeerBehavior behavior, bool start)
+{
+    peer.behavior = behavior;
+    peer.accepts = 0;
+    peer.requests = 0;
+    peer.running = start;
+    peer.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(peer.listen_fd, (struct sockaddr*) &address, sizeof(address));
+    socklen_t length = sizeof(address);
+    getsockname(peer.listen_fd, (struct sockaddr*) &address, &length);
+    peer.port = ntohs(address.sin_port);
+
+    if (start) {
+        listen(peer.listen_fd, 4);
+        pthread_create(&peer.thread, NULL, runPeer, &peer);
+    }
+}
+
+static void closePeer(StandInPeer& peer)
+{
+    if (peer.running) {
+        peer.running = false;
+        pthread_join(peer.thread, NULL);
+    }
+    close(peer.listen_fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Harness.
+
+struct Result
+{
+    int tag;
+    int status;
+    int attempts;
+};
+
+static std::vector<Result> results;
+static int failures = 0;
+
+static void recordResult(const HttpRequest& request, int status)
+{
+    Result result = { request.tag, status, request.attempts };
+    results.push_back(result);
+}
+
+static void check(bool condition, const char* test, const char* what)
+{
+    if (!condition) {
+        printf("FAIL %s: %s\n", test, what);
+        failures++;
+    }
+}
+
+// Pump the client until the expected number of callbacks or a deadline.
+static void pump(HttpClient& client, unsigned int expected, unsigned long limit_ms)
+{
+    unsigned long start = millis();
+    while (results.size() < expected && millis() - start < limit_ms) {
+        client.process();
+        usleep(1000);
+    }
+}
+
+static const IPAddress loopback(127, 0, 0, 1);
+static const std::string request = "POST /upnp/control/basicevent1 HTTP/1.1\r\n\r\n";
+
+////////////////////////////////////////////////////////////////////////////////
+// Tests.
+
+static void testKeepAliveReuse()
+{
+    const char* name = "keep-alive reuse";
+    StandInPeer peer;
+    openPeer(peer, kKeepAlive, true);
+    HttpClient client(recordResult);
+    results.clear();
+
+    client.enqueue(loopback, peer.port, request, 1);
+    pump(client, 1, 2000);
+    client.enqueue(loopback, peer.port, request, 2);
+    pump(client, 2, 2000);
+
+    check(results.size() == 2, name, "both requests complete");
+    check(results.size() == 2 && results[0].status == 200 && results[1].status == 200, name, "status 200");
+    check(peer.accepts == 1, name, "second request reuses the connection");
+    closePeer(peer);
+}
+
+static void testConnectionClose()
+{
+    const char* name = "connection close";
+    StandInPeer peer;
+    openPeer(peer, kFauxmo, true);
+    HttpClient client(recordResult);
+    results.clear();
+
+    client.enqueue(loopback, peer.port, request, 1);
+    pump(client, 1, 2000);
+    client.enqueue(loopback, peer.port, request, 2);
+    pump(client, 2, 2000);
+
+    check(results.size() == 2, name, "both requests complete");
+    check(results.size() == 2 && results[0].status == 200 && results[1].status == 200, name, "status 200");
+    check(peer.accepts == 2, name, "reconnects after the peer closes");
+    closePeer(peer);
+}
+
+static void testTimeoutRetry()
+{
+    const char* name = "timeout retry";
+    StandInPeer peer;
+    openPeer(peer, kSilentOnce, true);
+    HttpClient client(recordResult);
+    results.clear();
+
+    client.enqueue(loopback, peer.port, request, 1);
+    pump(client, 1, 5000);
+
+    check(results.size() == 1 && results[0].status == 200, name, "succeeds after a timeout");
+    check(results.size() == 1 && results[0].attempts == 2, name, "took two attempts");
+    closePeer(peer);
+}
+
+static void testRetryExhaustion()
+{
+    const char* name = "retry exhaustion";
+    StandInPeer peer;
+    openPeer(peer, kSilent, true);
+    HttpClient client(recordResult);
+    results.clear();
+
+    client.enqueue(loopback, peer.port, request, 1);
+    pump(client, 1, 10000);
+
+    check(results.size() == 1 && results[0].status == -1, name, "reported as failed");
+    check(results.size() == 1 && results[0].attempts == HTTP_CLIENT_MAX_ATTEMPTS, name, "used every attempt");
+    check(peer.requests == HTTP_CLIENT_MAX_ATTEMPTS, name, "peer saw every attempt");
+    closePeer(peer);
+}
+
+static void testUnreachable()
+{
+    const char* name = "unreachable";
+    StandInPeer peer;
+    openPeer(peer, kKeepAlive, false);
+    HttpClient client(recordResult);
+    results.clear();
+
+    client.enqueue(loopback, peer.port, request, 1);
+    pump(client, 1, 2000);
+
+    check(results.size() == 1 && results[0].status == -1, name, "reported as failed");
+    check(results.size() == 1 && results[0].attempts == 1, name, "connect is not retried");
+    check(!client.enqueue(loopback, peer.port, request, 2), name, "refused during cool-down");
+    check(client.pending() == 0, name, "nothing left queued");
+    closePeer(peer);
+}
+
+static void testCoalesceAndBound()
+{
+    const char* name = "coalesce and bound";
+    StandInPeer peer;
+    openPeer(peer, kKeepAlive, true);
+    HttpClient client(recordResult);
+    results.clear();
+
+    client.enqueue(loopback, peer.port, request, 1);
+    client.enqueue(loopback, peer.port, request, 2);
+    check(client.pending() == 1, name, "same peer supersedes the pending request");
+
+    for (int i = 1; i < HTTP_CLIENT_QUEUE_SIZE; i++) {
+        check(client.enqueue(IPAddress(127, 0, 0, 2 + i), 9, request, 10 + i), name, "distinct peers are queued");
+    }
+    check(!client.enqueue(IPAddress(127, 0, 0, 99), 9, request, 99), name, "full queue refuses");
+
+    pump(client, 1, 2000);
+    check(results.size() >= 1 && results[0].tag == 2 && results[0].status == 200, name, "latest request is sent");
+    closePeer(peer);
+}
+
+int main()
+{
+    testKeepAliveReuse();
+    testConnectionClose();
+    testTimeoutRetry();
+    testRetryExhaustion();
+    testUnreachable();
+    testCoalesceAndBound();
+
+    if (failures == 0) printf("http_client_test: all tests passed\n");
+    return failures == 0 ? 0 : 1;
+}